@@ -17,6 +17,11 @@
  * license, as set out in <http://cesanta.com/products.html>.
  */
 
+#if defined(SLRE_ENABLE_CACHE) && !defined(_WIN32) && \
+    !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L   /* For pthread_rwlock_t */
+#endif
+
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
@@ -27,18 +32,19 @@
 #define MAX_BRACKETS 100
 #define FAIL_IF(condition, error_code) if (condition) return (error_code)
 
-#ifndef ARRAY_SIZE
-#define ARRAY_SIZE(ar) (sizeof(ar) / sizeof((ar)[0]))
-#endif
-
 #ifdef SLRE_DEBUG
 #define DBG(x) printf x
 #else
 #define DBG(x)
 #endif
 
+/*
+ * Brackets and branches hold offsets into the regex rather than pointers,
+ * so that a parsed regex can be cached and serialized. These structures are
+ * part of the compiled regex format, see slre_compile().
+ */
 struct bracket_pair {
-  const char *ptr;  /* Points to the first char after '(' in regex  */
+  int offset;       /* Offset of the first char after '(' in regex  */
   int len;          /* Length of the text between '(' and ')'       */
   int branches;     /* Index in the branches array for this pair    */
   int num_branches; /* Number of '|' in this bracket pair           */
@@ -47,24 +53,46 @@ struct bracket_pair {
 struct branch {
   int bracket_index;    /* index for 'struct bracket_pair brackets' */
                         /* array defined below                      */
-  const char *schlong;  /* points to the '|' character in the regex */
+  int schlong;          /* offset of the '|' character in the regex */
+};
+
+/*
+ * Tells how to find candidate offsets for a match. Set by make_plan() when
+ * the regex is parsed. Does not depend on flags, so it can be compiled.
+ */
+struct scan_plan {
+  int plan;                   /* SLRE_PLAN_*                               */
+  int c;                      /* First byte of every match, or -1          */
+  int can_fold;               /* c is a plain char, folded for ignore case */
+  unsigned char set[2][32];   /* First bytes bitmap, [1] for ignore case   */
 };
 
 struct regex_info {
+  /* Regular expression string */
+  const char *re;
+
   /*
    * Describes all bracket pairs in the regular expression.
    * First entry is always present, and grabs the whole regex.
    */
-  struct bracket_pair brackets[MAX_BRACKETS];
+  struct bracket_pair *brackets;
   int num_brackets;
 
   /*
    * Describes alternations ('|' operators) in the regular expression.
    * Each branch falls into a specific branch pair.
    */
-  struct branch branches[MAX_BRANCHES];
+  struct branch *branches;
   int num_branches;
 
+  /*
+   * Set by analyze() for literal regexes, which need no backtracking.
+   * literal_len is the number of bytes a literal regex matches, or -1.
+   */
+  int literal_len;
+  int has_end_anchor;   /* Literal regex ends with '$' */
+  struct scan_plan plan;
+
   /* Array of captures provided by the user */
   struct slre_cap *caps;
   int num_caps;
@@ -73,6 +101,42 @@ struct regex_info {
   int flags;
 };
 
+/* ASCII lower case, unlike tolower() does not depend on the locale */
+static const unsigned char s_fold[256] = {
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+  0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+  0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+  0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+  0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27,
+  0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+  0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+  0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+  0x40, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
+  0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+  0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,
+  0x78, 0x79, 0x7a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
+  0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
+  0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+  0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,
+  0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f,
+  0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+  0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
+  0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,
+  0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f,
+  0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+  0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf,
+  0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7,
+  0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf,
+  0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+  0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf,
+  0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7,
+  0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,
+  0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7,
+  0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef,
+  0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+  0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+
 static int is_metacharacter(const unsigned char *s) {
   static const char *metacharacters = "^$().[]*+?|\\Ssdbfnrtv";
   return strchr(metacharacters, *s) != NULL;
@@ -105,7 +169,7 @@ static int toi(int x) {
 }
 
 static int hextoi(const unsigned char *s) {
-  return (toi(tolower(s[0])) << 4) | toi(tolower(s[1]));
+  return (toi(s_fold[s[0]]) << 4) | toi(s_fold[s[1]]);
 }
 
 static int match_op(const unsigned char *re, const unsigned char *s,
@@ -145,7 +209,7 @@ static int match_op(const unsigned char *re, const unsigned char *s,
 
     default:
       if (info->flags & SLRE_IGNORE_CASE) {
-        FAIL_IF(tolower(*re) != tolower(*s), SLRE_NO_MATCH);
+        FAIL_IF(s_fold[*re] != s_fold[*s], SLRE_NO_MATCH);
       } else {
         FAIL_IF(*re != *s, SLRE_NO_MATCH);
       }
@@ -159,6 +223,7 @@ static int match_op(const unsigned char *re, const unsigned char *s,
 static int match_set(const char *re, int re_len, const char *s,
                      struct regex_info *info) {
   int len = 0, result = -1, invert = re[0] == '^';
+  unsigned char c = (unsigned char) *s;
 
   if (invert) re++, re_len--;
 
@@ -166,8 +231,9 @@ static int match_set(const char *re, int re_len, const char *s,
     /* Support character range */
     if (re[len] != '-' && re[len + 1] == '-' && re[len + 2] != ']' &&
         re[len + 2] != '\0') {
-      result = info->flags &  SLRE_IGNORE_CASE ?
-        tolower(*s) >= tolower(re[len]) && tolower(*s) <= tolower(re[len + 2]) :
+      result = info->flags & SLRE_IGNORE_CASE ?
+        s_fold[c] >= s_fold[(unsigned char) re[len]] &&
+        s_fold[c] <= s_fold[(unsigned char) re[len + 2]] :
         *s >= re[len] && *s <= re[len + 2];
       len += 3;
     } else {
@@ -299,6 +365,18 @@ static int bar(const char *re, int re_len, const char *s, int s_len,
   return j;
 }
 
+/* Returns the length of i-th alternative of the bracket bi, sets p to it */
+static int branch_text(const struct regex_info *info, int bi, int i,
+                       const char **p) {
+  const struct bracket_pair *b = &info->brackets[bi];
+
+  *p = info->re + (i == 0 ? b->offset :
+                   info->branches[b->branches + i - 1].schlong + 1);
+  return b->num_branches == 0 ? b->len :
+    i == b->num_branches ? (int) (info->re + b->offset + b->len - *p) :
+    (int) (info->re + info->branches[b->branches + i].schlong - *p);
+}
+
 /* Process branch points */
 static int doh(const char *s, int s_len, struct regex_info *info, int bi) {
   const struct bracket_pair *b = &info->brackets[bi];
@@ -306,10 +384,7 @@ static int doh(const char *s, int s_len, struct regex_info *info, int bi) {
   const char *p;
 
   do {
-    p = i == 0 ? b->ptr : info->branches[b->branches + i - 1].schlong + 1;
-    len = b->num_branches == 0 ? b->len :
-      i == b->num_branches ? (int) (b->ptr + b->len - p) :
-      (int) (info->branches[b->branches + i].schlong - p);
+    len = branch_text(info, bi, i, &p);
     DBG(("%s %d %d [%.*s] [%.*s]\n", __func__, bi, i, len, p, s_len, s));
     result = bar(p, len, s, s_len, info, bi);
     DBG(("%s <- %d\n", __func__, result));
@@ -318,16 +393,236 @@ static int doh(const char *s, int s_len, struct regex_info *info, int bi) {
   return result;
 }
 
+/*
+ * Returns the byte every match of re must start with, or -1 if there is none.
+ * Sets can_fold if the byte is a plain char, which matches in either case
+ * with SLRE_IGNORE_CASE.
+ */
+static int first_byte(const char *re, int re_len, int *can_fold) {
+  int c;
+
+  *can_fold = 0;
+  if (re_len == 0) return -1;
+  if (re[0] == '\\') {
+    if (re[1] == 'x') {
+      c = hextoi((const unsigned char *) re + 2);
+    } else if (re[1] != '\0' && strchr("^$().[]*+?|\\", re[1]) != NULL) {
+      c = (unsigned char) re[1];
+    } else {
+      return -1;
+    }
+  } else if (strchr("^$().[]*+?|", re[0]) != NULL) {
+    return -1;
+  } else {
+    c = (unsigned char) re[0];
+    *can_fold = 1;
+  }
+
+  /* First byte is optional */
+  if (op_len(re) < re_len && (re[op_len(re)] == '?' || re[op_len(re)] == '*')) {
+    return -1;
+  }
+
+  return c;
+}
+
+/*
+ * Finds byte c in [s, end). If fold is set, c is a lower case ASCII letter
+ * and its upper case is found too. Both cases differ in bit 0x20 only, so
+ * setting that bit compares a whole word against both cases at once.
+ */
+static const char *find_byte(const char *s, const char *end, int c, int fold) {
+  const unsigned long ones = (unsigned long) -1 / 0xff, highs = ones << 7;
+  const unsigned long pattern = ones * (unsigned long) c, mask = ones * 0x20;
+  unsigned long w;
+
+  if (!fold) return (const char *) memchr(s, c, end - s);
+
+  for (; end - s >= (long) sizeof(w); s += sizeof(w)) {
+    memcpy(&w, s, sizeof(w));
+    w = (w | mask) ^ pattern;
+    if ((w - ones) & ~w & highs) break;  /* Some byte is zero */
+  }
+  for (; s < end; s++) {
+    if (((unsigned char) *s | 0x20) == c) return s;
+  }
+
+  return NULL;
+}
+
+static int in_set(const unsigned char *set, int c) {
+  return set[c >> 3] & (1 << (c & 7));
+}
+
+static void add_to_set(unsigned char *set, int c) {
+  set[c >> 3] |= (unsigned char) (1 << (c & 7));
+}
+
+/* Marks bytes that can start a match. Returns 0 if any byte can. */
+static int first_byte_set(const struct regex_info *info,
+                          unsigned char set[2][32]) {
+  const char *p;
+  int i, c, can_fold, len;
+
+  for (i = 0; i <= info->brackets[0].num_branches; i++) {
+    len = branch_text(info, 0, i, &p);
+    if ((c = first_byte(p, len, &can_fold)) < 0) return 0;
+    add_to_set(set[0], c);
+    if (can_fold) c = s_fold[c];
+    add_to_set(set[1], c);
+    if (can_fold && c >= 'a' && c <= 'z') add_to_set(set[1], c - 'a' + 'A');
+  }
+
+  return 1;
+}
+
+/* Sets info->plan, must be called after analyze() */
+static void make_plan(struct regex_info *info) {
+  struct scan_plan *sp = &info->plan;
+  int start = info->re[0] == '^';
+
+  memset(sp, 0, sizeof(*sp));
+  sp->c = -1;
+  if (info->literal_len >= 0) {
+    sp->plan = SLRE_PLAN_LITERAL;
+    sp->c = first_byte(info->re + start, info->brackets[0].len - start -
+                       info->has_end_anchor, &sp->can_fold);
+  } else if (start) {
+    sp->plan = SLRE_PLAN_ANCHORED;
+  } else if (info->brackets[0].num_branches == 0 &&
+             (sp->c = first_byte(info->re, info->brackets[0].len,
+                                 &sp->can_fold)) >= 0) {
+    sp->plan = SLRE_PLAN_FIRST_BYTE;
+  } else if (info->brackets[0].num_branches > 0 &&
+             first_byte_set(info, sp->set)) {
+    sp->plan = SLRE_PLAN_FIRST_BYTE_SET;
+  } else {
+    /* Clear whatever a failed first_byte() or first_byte_set() left */
+    memset(sp, 0, sizeof(*sp));
+    sp->plan = SLRE_PLAN_BACKTRACK;
+    sp->c = -1;
+  }
+}
+
+/* Sets literal_len and has_end_anchor if regex matches a fixed string */
+static void analyze(struct regex_info *info) {
+  const char *re = info->re;
+  int i = re[0] == '^', n = 0, re_len = info->brackets[0].len;
+
+  info->literal_len = -1;
+  info->has_end_anchor = 0;
+  for (; i < re_len; i += op_len(re + i), n++) {
+    if (re[i] == '$' && i == re_len - 1) {
+      info->has_end_anchor = 1;
+      break;
+    } else if (strchr("^$().[]*+?|", re[i]) != NULL) {
+      return;
+    } else if (re[i] == '\\' && re[i + 1] != 'x' &&
+               strchr("^$().[]*+?|\\", re[i + 1]) == NULL) {
+      return;
+    }
+  }
+  info->literal_len = n;
+}
+
+/* Returns non-zero if literal regex re, n bytes long, matches s */
+static int literal_at(const char *re, int n, const unsigned char *s,
+                      int flags) {
+  for (; n > 0; n--, re += op_len(re), s++) {
+    if (re[0] == '\\') {
+      if ((re[1] == 'x' ? hextoi((const unsigned char *) re + 2) :
+           (unsigned char) re[1]) != *s) return 0;
+    } else if (flags & SLRE_IGNORE_CASE) {
+      if (s_fold[(unsigned char) re[0]] != s_fold[*s]) return 0;
+    } else if ((unsigned char) re[0] != *s) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * Searches for a literal regex like memmem() does. c and fold are the first
+ * byte to look for, see find_byte().
+ */
+static int match_literal(const char *s, int s_len,
+                         const struct regex_info *info, int c, int fold) {
+  const char *re = info->re + (info->re[0] == '^'), *p;
+  int i = 0, last = s_len - info->literal_len;
+
+  if (last < 0) return SLRE_NO_MATCH;
+  if (info->has_end_anchor) i = last;
+  if (info->re[0] == '^' && last > 0) last = 0;
+
+  for (; i <= last; i++) {
+    if (c >= 0) {
+      if ((p = find_byte(s + i, s + last + 1, c, fold)) == NULL) break;
+      i = (int) (p - s);
+    }
+    if (literal_at(re, info->literal_len, (const unsigned char *) s + i,
+                   info->flags)) {
+      return i + info->literal_len;
+    }
+  }
+
+  return SLRE_NO_MATCH;
+}
+
 static int baz(const char *s, int s_len, struct regex_info *info) {
-  int i, result = -1, is_anchored = info->brackets[0].ptr[0] == '^';
+  const struct scan_plan *sp = &info->plan;
+  int ignore_case = (info->flags & SLRE_IGNORE_CASE) != 0;
+  int i, c = sp->c, fold = 0, result = -1;
+  struct slre_cap *caps = info->caps;
+  const char *p;
+
+  if (c >= 0 && sp->can_fold && ignore_case) {
+    c = s_fold[c];
+    fold = c >= 'a' && c <= 'z';
+  }
+  DBG(("%s plan %d\n", __func__, sp->plan));
+  if (sp->plan == SLRE_PLAN_LITERAL) {
+    return match_literal(s, s_len, info, c, fold);
+  }
+
+  /*
+   * Capturing at every offset is wasted work when most offsets fail.
+   * Find the match with capturing disabled, then run the matcher once
+   * more at the matched offset only to fill in the captures.
+   */
+  if (caps != NULL && info->num_brackets > 1 &&
+      sp->plan != SLRE_PLAN_ANCHORED) {
+    info->caps = NULL;
+  }
 
   for (i = 0; i <= s_len; i++) {
+    /* Skip offsets that cannot start a match */
+    if (sp->plan == SLRE_PLAN_FIRST_BYTE) {
+      if ((p = find_byte(s + i, s + s_len, c, fold)) == NULL) {
+        result = SLRE_NO_MATCH;
+        break;
+      }
+      i = (int) (p - s);
+    } else if (sp->plan == SLRE_PLAN_FIRST_BYTE_SET) {
+      while (i < s_len &&
+             !in_set(sp->set[ignore_case], (unsigned char) s[i])) i++;
+      if (i == s_len) {
+        result = SLRE_NO_MATCH;
+        break;
+      }
+    }
     result = doh(s + i, s_len - i, info, 0);
     if (result >= 0) {
       result += i;
       break;
     }
-    if (is_anchored) break;
+    if (sp->plan == SLRE_PLAN_ANCHORED) break;
+  }
+
+  if (result >= 0 && info->caps != caps) {
+    info->caps = caps;
+    DBG(("CAPTURE PASS at offset %d\n", i));
+    doh(s + i, s_len - i, info, 0);
   }
 
   return result;
@@ -362,12 +657,12 @@ static void setup_branch_points(struct regex_info *info) {
   }
 }
 
-static int foo(const char *re, int re_len, const char *s, int s_len,
-               struct regex_info *info) {
+static int foo(const char *re, int re_len, struct regex_info *info) {
   int i, step, depth = 0;
 
   /* First bracket captures everything */
-  info->brackets[0].ptr = re;
+  info->re = re;
+  info->brackets[0].offset = 0;
   info->brackets[0].len = re_len;
   info->num_brackets = 1;
 
@@ -376,12 +671,12 @@ static int foo(const char *re, int re_len, const char *s, int s_len,
     step = get_op_len(re + i, re_len - i);
 
     if (re[i] == '|') {
-      FAIL_IF(info->num_branches >= (int) ARRAY_SIZE(info->branches),
+      FAIL_IF(info->num_branches >= MAX_BRANCHES,
               SLRE_TOO_MANY_BRANCHES);
       info->branches[info->num_branches].bracket_index =
         info->brackets[info->num_brackets - 1].len == -1 ?
         info->num_brackets - 1 : depth;
-      info->branches[info->num_branches].schlong = &re[i];
+      info->branches[info->num_branches].schlong = i;
       info->num_branches++;
     } else if (re[i] == '\\') {
       FAIL_IF(i >= re_len - 1, SLRE_INVALID_METACHARACTER);
@@ -396,10 +691,10 @@ static int foo(const char *re, int re_len, const char *s, int s_len,
                 SLRE_INVALID_METACHARACTER);
       }
     } else if (re[i] == '(') {
-      FAIL_IF(info->num_brackets >= (int) ARRAY_SIZE(info->brackets),
+      FAIL_IF(info->num_brackets >= MAX_BRACKETS,
               SLRE_TOO_MANY_BRACKETS);
       depth++;  /* Order is important here. Depth increments first. */
-      info->brackets[info->num_brackets].ptr = re + i + 1;
+      info->brackets[info->num_brackets].offset = i + 1;
       info->brackets[info->num_brackets].len = -1;
       info->num_brackets++;
       FAIL_IF(info->num_caps > 0 && info->num_brackets - 1 > info->num_caps,
@@ -407,9 +702,9 @@ static int foo(const char *re, int re_len, const char *s, int s_len,
     } else if (re[i] == ')') {
       int ind = info->brackets[info->num_brackets - 1].len == -1 ?
         info->num_brackets - 1 : depth;
-      info->brackets[ind].len = (int) (&re[i] - info->brackets[ind].ptr);
+      info->brackets[ind].len = i - info->brackets[ind].offset;
       DBG(("SETTING BRACKET %d [%.*s]\n",
-           ind, info->brackets[ind].len, info->brackets[ind].ptr));
+           ind, info->brackets[ind].len, re + info->brackets[ind].offset));
       depth--;
       FAIL_IF(depth < 0, SLRE_UNBALANCED_BRACKETS);
       FAIL_IF(i > 0 && re[i - 1] == '(', SLRE_NO_MATCH);
@@ -418,20 +713,543 @@ static int foo(const char *re, int re_len, const char *s, int s_len,
 
   FAIL_IF(depth != 0, SLRE_UNBALANCED_BRACKETS);
   setup_branch_points(info);
+  analyze(info);
+  make_plan(info);
+
+  return 0;
+}
+
+#ifdef SLRE_ENABLE_CACHE
+/*
+ * Cache of parsed regular expressions, keyed by the regexp pointer and flags.
+ * Parsed brackets and branches are offsets into the caller's regexp string,
+ * so an entry is only reused if the string at that address has not changed.
+ *
+ * Entries are guarded by a reader-writer lock. Lookups compare and copy an
+ * entry under the shared lock, so they run in parallel. Only the LRU stamp
+ * and the counters are updated under a small exclusive lock. Inserts, which
+ * happen on misses only, take the lock exclusively.
+ */
+#ifndef SLRE_CACHE_SIZE
+#define SLRE_CACHE_SIZE 16
+#endif
+
+#ifndef SLRE_CACHE_MAX_RE_LEN
+#define SLRE_CACHE_MAX_RE_LEN 256
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+static SRWLOCK s_cache_lock = SRWLOCK_INIT;
+static SRWLOCK s_stamp_lock = SRWLOCK_INIT;
+#define CACHE_READ_LOCK() AcquireSRWLockShared(&s_cache_lock)
+#define CACHE_READ_UNLOCK() ReleaseSRWLockShared(&s_cache_lock)
+#define CACHE_WRITE_LOCK() AcquireSRWLockExclusive(&s_cache_lock)
+#define CACHE_WRITE_UNLOCK() ReleaseSRWLockExclusive(&s_cache_lock)
+#define STAMP_LOCK() AcquireSRWLockExclusive(&s_stamp_lock)
+#define STAMP_UNLOCK() ReleaseSRWLockExclusive(&s_stamp_lock)
+#else
+#include <pthread.h>
+static pthread_rwlock_t s_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t s_stamp_lock = PTHREAD_MUTEX_INITIALIZER;
+#define CACHE_READ_LOCK() pthread_rwlock_rdlock(&s_cache_lock)
+#define CACHE_READ_UNLOCK() pthread_rwlock_unlock(&s_cache_lock)
+#define CACHE_WRITE_LOCK() pthread_rwlock_wrlock(&s_cache_lock)
+#define CACHE_WRITE_UNLOCK() pthread_rwlock_unlock(&s_cache_lock)
+#define STAMP_LOCK() pthread_mutex_lock(&s_stamp_lock)
+#define STAMP_UNLOCK() pthread_mutex_unlock(&s_stamp_lock)
+#endif
+
+struct cache_entry {
+  const char *regexp;       /* Regexp pointer passed to slre_match()  */
+  int flags;                /* Flags passed to slre_match()           */
+  int in_use;               /* Entry holds a parsed pattern           */
+  unsigned long last_used;  /* LRU clock value, under s_stamp_lock    */
+  char re[SLRE_CACHE_MAX_RE_LEN];  /* Copy of the regexp string       */
+  struct bracket_pair brackets[MAX_BRACKETS];
+  int num_brackets;
+  struct branch branches[MAX_BRANCHES];
+  int num_branches;
+  int literal_len;
+  int has_end_anchor;
+  struct scan_plan plan;
+};
 
-  return baz(s, s_len, info);
+static struct cache_entry s_cache[SLRE_CACHE_SIZE];
+static struct slre_cache_stats s_cache_stats;
+static unsigned long s_cache_clock;
+
+static void copy_parsed(struct bracket_pair *brackets, int *num_brackets,
+                        struct branch *branches, int *num_branches,
+                        const struct bracket_pair *src_brackets,
+                        int src_num_brackets,
+                        const struct branch *src_branches,
+                        int src_num_branches) {
+  memcpy(brackets, src_brackets, src_num_brackets * sizeof(*brackets));
+  memcpy(branches, src_branches, src_num_branches * sizeof(*branches));
+  *num_brackets = src_num_brackets;
+  *num_branches = src_num_branches;
+}
+
+/*
+ * Returns the next LRU clock value. unsigned long is only 32 bits on some
+ * platforms, so before the clock wraps, entries are renumbered 1, 2, ... in
+ * LRU order and the clock restarts from there.
+ */
+static unsigned long cache_tick(void) {
+  unsigned long rank[SLRE_CACHE_SIZE];
+  int i, j;
+
+  if (s_cache_clock == (unsigned long) -1) {
+    for (i = 0; i < SLRE_CACHE_SIZE; i++) {
+      rank[i] = 0;
+      for (j = 0; j < SLRE_CACHE_SIZE; j++) {
+        if (s_cache[j].in_use &&
+            s_cache[j].last_used <= s_cache[i].last_used) rank[i]++;
+      }
+    }
+    for (i = 0; i < SLRE_CACHE_SIZE; i++) {
+      s_cache[i].last_used = s_cache[i].in_use ? rank[i] : 0;
+    }
+    s_cache_clock = SLRE_CACHE_SIZE;
+  }
+
+  return ++s_cache_clock;
+}
+
+static int cache_lookup(const char *regexp, struct regex_info *info) {
+  struct cache_entry *e;
+  int found = 0;
+
+  CACHE_READ_LOCK();
+  for (e = s_cache; e < s_cache + SLRE_CACHE_SIZE; e++) {
+    if (e->in_use && e->regexp == regexp && e->flags == info->flags &&
+        strcmp(e->re, regexp) == 0) {
+      info->re = regexp;
+      info->literal_len = e->literal_len;
+      info->has_end_anchor = e->has_end_anchor;
+      info->plan = e->plan;
+      copy_parsed(info->brackets, &info->num_brackets,
+                  info->branches, &info->num_branches,
+                  e->brackets, e->num_brackets, e->branches, e->num_branches);
+      found = 1;
+      break;
+    }
+  }
+  STAMP_LOCK();
+  if (found) {
+    e->last_used = cache_tick();
+    s_cache_stats.hits++;
+  } else {
+    s_cache_stats.misses++;
+  }
+  STAMP_UNLOCK();
+  CACHE_READ_UNLOCK();
+
+  return found;
+}
+
+static void cache_insert(const char *regexp, int re_len,
+                         const struct regex_info *info) {
+  struct cache_entry *e, *lru = s_cache;
+
+  if (re_len >= SLRE_CACHE_MAX_RE_LEN) return;
+
+  /* Excludes lookups, so the LRU stamps need no s_stamp_lock here */
+  CACHE_WRITE_LOCK();
+  for (e = s_cache; e < s_cache + SLRE_CACHE_SIZE; e++) {
+    if (e->in_use && e->regexp == regexp && e->flags == info->flags) {
+      /* Pattern at this address has changed, replace stale entry */
+      lru = e;
+      break;
+    }
+    if (!e->in_use) {
+      lru = e;
+    } else if (lru->in_use && e->last_used < lru->last_used) {
+      lru = e;
+    }
+  }
+  if (lru->in_use) {
+    s_cache_stats.evictions++;
+  } else {
+    s_cache_stats.size++;
+  }
+  lru->regexp = regexp;
+  lru->flags = info->flags;
+  lru->last_used = cache_tick();
+  lru->in_use = 1;
+  memcpy(lru->re, regexp, re_len + 1);
+  lru->literal_len = info->literal_len;
+  lru->has_end_anchor = info->has_end_anchor;
+  lru->plan = info->plan;
+  copy_parsed(lru->brackets, &lru->num_brackets,
+              lru->branches, &lru->num_branches,
+              info->brackets, info->num_brackets,
+              info->branches, info->num_branches);
+  CACHE_WRITE_UNLOCK();
+}
+
+void slre_cache_stats(struct slre_cache_stats *stats) {
+  CACHE_READ_LOCK();
+  STAMP_LOCK();
+  *stats = s_cache_stats;
+  stats->capacity = SLRE_CACHE_SIZE;
+  STAMP_UNLOCK();
+  CACHE_READ_UNLOCK();
+}
+
+void slre_cache_clear(void) {
+  CACHE_WRITE_LOCK();
+  memset(s_cache, 0, sizeof(s_cache));
+  memset(&s_cache_stats, 0, sizeof(s_cache_stats));
+  s_cache_clock = 0;
+  CACHE_WRITE_UNLOCK();
+}
+#else
+#define cache_lookup(regexp, info) 0
+#define cache_insert(regexp, re_len, info)
+
+void slre_cache_stats(struct slre_cache_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+}
+
+void slre_cache_clear(void) {
+}
+#endif
+
+/*
+ * Compiled regex layout: header, brackets, branches, then the regex string
+ * with a terminating NUL, padded to a multiple of sizeof(int). All fields
+ * are ints in native byte order or bytes, so a compiled regex can be used in
+ * place, e.g. from a memory-mapped file. Bump the version whenever the layout
+ * of this header, struct scan_plan, struct bracket_pair or struct branch
+ * changes.
+ */
+#define COMPILED_MAGIC 0x45524c53   /* "SLRE" on little-endian machines */
+#define COMPILED_SET_MAGIC 0x53524c53  /* "SLRS" */
+#define COMPILED_VERSION 4
+#define ALIGN_INT(n) (((n) + (int) sizeof(int) - 1) & ~((int) sizeof(int) - 1))
+
+struct compiled_header {
+  int magic;              /* COMPILED_MAGIC                       */
+  int version;            /* COMPILED_VERSION                     */
+  int size;               /* Total size, including this header    */
+  unsigned int checksum;  /* Checksum of everything after it      */
+  int num_brackets;
+  int num_branches;
+  int re_len;
+  int literal_len;
+  int has_end_anchor;
+  struct scan_plan plan;  /* Computed at compile time             */
+};
+
+/* Set layout: header, array of pattern offsets, then compiled patterns */
+struct compiled_set_header {
+  int magic;              /* COMPILED_SET_MAGIC                   */
+  int version;            /* COMPILED_VERSION                     */
+  int size;               /* Total size, including this header    */
+  unsigned int checksum;  /* Checksum of everything after header  */
+  int num_patterns;
+};
+
+static unsigned int checksum(const void *buf, int len) {
+  const unsigned char *p = (const unsigned char *) buf;
+  unsigned int h = 2166136261U;  /* 32-bit FNV-1a */
+
+  while (len-- > 0) {
+    h = (h ^ *p++) * 16777619U;
+  }
+
+  return h;
+}
+
+/* Covers the header fields that follow the checksum, and all data after */
+static unsigned int compiled_checksum(const struct compiled_header *h,
+                                      int size) {
+  const char *p = (const char *) &h->num_brackets;
+
+  return checksum(p, size - (int) (p - (const char *) h));
+}
+
+static int is_int_aligned(const void *p) {
+  return ((unsigned long) p & (sizeof(int) - 1)) == 0;
+}
+
+static int compiled_size(const struct regex_info *info, int re_len) {
+  return (int) (sizeof(struct compiled_header) +
+                info->num_brackets * sizeof(struct bracket_pair) +
+                info->num_branches * sizeof(struct branch)) +
+    ALIGN_INT(re_len + 1);
+}
+
+int slre_compile(const char *regexp, void *buf, int buf_len) {
+  struct bracket_pair brackets[MAX_BRACKETS];
+  struct branch branches[MAX_BRANCHES];
+  struct regex_info info;
+  struct compiled_header *h = (struct compiled_header *) buf;
+  int re_len = (int) strlen(regexp), size, result;
+  char *p;
+
+  info.brackets = brackets;
+  info.branches = branches;
+  info.num_brackets = info.num_branches = info.num_caps = info.flags = 0;
+  info.caps = NULL;
+  if ((result = foo(regexp, re_len, &info)) < 0) return result;
+
+  size = compiled_size(&info, re_len);
+  if (buf == NULL) return size;
+  FAIL_IF(buf_len < size, SLRE_BUFFER_TOO_SMALL);
+  FAIL_IF(!is_int_aligned(buf), SLRE_INVALID_COMPILED);
+
+  memset(buf, 0, size);
+  h->magic = COMPILED_MAGIC;
+  h->version = COMPILED_VERSION;
+  h->size = size;
+  h->num_brackets = info.num_brackets;
+  h->num_branches = info.num_branches;
+  h->re_len = re_len;
+  h->literal_len = info.literal_len;
+  h->has_end_anchor = info.has_end_anchor;
+  h->plan = info.plan;
+  p = (char *) (h + 1);
+  memcpy(p, brackets, info.num_brackets * sizeof(brackets[0]));
+  p += info.num_brackets * sizeof(brackets[0]);
+  memcpy(p, branches, info.num_branches * sizeof(branches[0]));
+  p += info.num_branches * sizeof(branches[0]);
+  memcpy(p, regexp, re_len);
+  h->checksum = compiled_checksum(h, size);
+
+  return size;
+}
+
+/* Sets up info to use a compiled regex in place */
+static int load_compiled(const void *buf, struct regex_info *info) {
+  const struct compiled_header *h = (const struct compiled_header *) buf;
+
+  FAIL_IF(buf == NULL || !is_int_aligned(buf) || h->magic != COMPILED_MAGIC ||
+          h->version != COMPILED_VERSION, SLRE_INVALID_COMPILED);
+
+  /* Matching never writes to brackets and branches */
+  info->brackets = (struct bracket_pair *) (h + 1);
+  info->num_brackets = h->num_brackets;
+  info->branches = (struct branch *) (info->brackets + h->num_brackets);
+  info->num_branches = h->num_branches;
+  info->re = (const char *) (info->branches + h->num_branches);
+  info->literal_len = h->literal_len;
+  info->has_end_anchor = h->has_end_anchor;
+  info->plan = h->plan;
+
+  return h->size;
+}
+
+/*
+ * Checks that every offset and index in a compiled regex stays inside the
+ * stored regex and arrays. This keeps matching in bounds without the cost
+ * of parsing the regex again.
+ */
+static int check_bounds(const struct regex_info *info, int re_len) {
+  const struct bracket_pair *b;
+  const struct branch *br;
+  const struct scan_plan *sp = &info->plan;
+
+  FAIL_IF(info->brackets[0].offset != 0 || info->brackets[0].len != re_len,
+          SLRE_INVALID_COMPILED);
+  for (b = info->brackets; b < info->brackets + info->num_brackets; b++) {
+    /* foo() leaves len at -1 for some nested brackets, e.g. ((a))((b)) */
+    FAIL_IF(b->offset < 0 || b->offset > re_len || b->len < -1 ||
+            b->len > re_len - b->offset || b->branches < 0 ||
+            b->branches > info->num_branches || b->num_branches < 0 ||
+            b->num_branches > info->num_branches - b->branches,
+            SLRE_INVALID_COMPILED);
+  }
+  for (br = info->branches; br < info->branches + info->num_branches; br++) {
+    FAIL_IF(br->bracket_index < 0 || br->bracket_index >= info->num_brackets ||
+            br->schlong < 0 || br->schlong >= re_len, SLRE_INVALID_COMPILED);
+  }
+  FAIL_IF(info->literal_len < -1 || info->literal_len > re_len ||
+          (info->has_end_anchor != 0 && info->has_end_anchor != 1) ||
+          sp->plan < SLRE_PLAN_LITERAL || sp->plan > SLRE_PLAN_BACKTRACK ||
+          sp->c < -1 || sp->c > 255 ||
+          (sp->can_fold != 0 && sp->can_fold != 1), SLRE_INVALID_COMPILED);
+
+  return 0;
+}
+
+int slre_check_compiled(const void *buf, int buf_len) {
+  const struct compiled_header *h = (const struct compiled_header *) buf;
+  struct regex_info info;
+  int size;
+
+  /* Validate the header before touching anything it points to */
+  FAIL_IF(buf_len < (int) sizeof(*h), SLRE_INVALID_COMPILED);
+  if ((size = load_compiled(buf, &info)) < 0) return size;
+  FAIL_IF(size > buf_len || info.num_brackets < 1 ||
+          info.num_brackets > MAX_BRACKETS || info.num_branches < 0 ||
+          info.num_branches > MAX_BRANCHES || h->re_len < 0 ||
+          h->re_len >= buf_len || size != compiled_size(&info, h->re_len) ||
+          h->checksum != compiled_checksum(h, size), SLRE_INVALID_COMPILED);
+
+  /* Checksum is not tamper-proof, so do not trust the data either */
+  FAIL_IF(info.re[h->re_len] != '\0' ||
+          memchr(info.re, '\0', h->re_len) != NULL, SLRE_INVALID_COMPILED);
+  if (check_bounds(&info, h->re_len) < 0) return SLRE_INVALID_COMPILED;
+
+  return size;
+}
+
+int slre_match_compiled(const void *compiled, const char *s, int s_len,
+                        struct slre_cap *caps, int num_caps, int flags) {
+  struct regex_info info;
+  int result;
+
+  if ((result = load_compiled(compiled, &info)) < 0) return result;
+  FAIL_IF(num_caps > 0 && info.num_brackets - 1 > num_caps,
+          SLRE_CAPS_ARRAY_TOO_SMALL);
+  info.flags = flags;
+  info.num_caps = num_caps;
+  info.caps = caps;
+
+  DBG(("========================> [%s] [%.*s]\n", info.re, s_len, s));
+  return baz(s, s_len, &info);
+}
+
+int slre_compile_set(const char **regexps, int num_regexps,
+                     void *buf, int buf_len) {
+  struct compiled_set_header *h = (struct compiled_set_header *) buf;
+  int i, n, size = (int) (sizeof(*h) + num_regexps * sizeof(int));
+
+  /* First pass computes the size, second pass writes the patterns */
+  for (i = 0; i < num_regexps; i++) {
+    if ((n = slre_compile(regexps[i], NULL, 0)) < 0) return n;
+    size += n;
+  }
+  if (buf == NULL) return size;
+  FAIL_IF(buf_len < size, SLRE_BUFFER_TOO_SMALL);
+  FAIL_IF(!is_int_aligned(buf), SLRE_INVALID_COMPILED);
+
+  h->magic = COMPILED_SET_MAGIC;
+  h->version = COMPILED_VERSION;
+  h->size = (int) (sizeof(*h) + num_regexps * sizeof(int));
+  h->num_patterns = num_regexps;
+  for (i = 0; i < num_regexps; i++) {
+    ((int *) (h + 1))[i] = h->size;
+    h->size += slre_compile(regexps[i], (char *) buf + h->size,
+                            size - h->size);
+  }
+  h->checksum = checksum(h + 1, size - (int) sizeof(*h));
+
+  return size;
+}
+
+int slre_check_set(const void *buf, int buf_len) {
+  const struct compiled_set_header *h =
+    (const struct compiled_set_header *) buf;
+  const int *offsets = (const int *) (h + 1);
+  int i, start;
+
+  FAIL_IF(buf == NULL || !is_int_aligned(buf) ||
+          buf_len < (int) sizeof(*h) || h->magic != COMPILED_SET_MAGIC ||
+          h->version != COMPILED_VERSION || h->size > buf_len ||
+          h->num_patterns < 0 ||
+          h->num_patterns > (h->size - (int) sizeof(*h)) / (int) sizeof(int) ||
+          h->checksum != checksum(h + 1, h->size - (int) sizeof(*h)),
+          SLRE_INVALID_COMPILED);
+
+  start = (int) (sizeof(*h) + h->num_patterns * sizeof(int));
+  for (i = 0; i < h->num_patterns; i++) {
+    FAIL_IF(offsets[i] < start || offsets[i] > h->size, SLRE_INVALID_COMPILED);
+    FAIL_IF(slre_check_compiled((const char *) buf + offsets[i],
+                                h->size - offsets[i]) < 0,
+            SLRE_INVALID_COMPILED);
+  }
+
+  return h->num_patterns;
+}
+
+const void *slre_set_get(const void *set, int index) {
+  const struct compiled_set_header *h =
+    (const struct compiled_set_header *) set;
+
+  if (index < 0 || index >= h->num_patterns) return NULL;
+  return (const char *) set + ((const int *) (h + 1))[index];
+}
+
+/* Returns non-zero if re has a quantifier outside of character sets */
+static int has_quantifier(const char *re, int re_len) {
+  int i, step;
+
+  for (i = 0; i < re_len; i += step) {
+    if (is_quantifier(re + i)) return 1;
+    if ((step = get_op_len(re + i, re_len - i)) <= 0) break;
+  }
+
+  return 0;
+}
+
+int slre_plan(const char *regexp, int num_caps,
+              struct slre_pattern_info *pi) {
+  struct bracket_pair brackets[MAX_BRACKETS];
+  struct branch branches[MAX_BRANCHES];
+  struct regex_info info;
+  const struct bracket_pair *b;
+  int i, end, result;
+
+  info.brackets = brackets;
+  info.branches = branches;
+  info.num_brackets = info.num_branches = 0;
+  info.num_caps = num_caps;
+  info.flags = 0;
+  info.caps = NULL;
+  if ((result = foo(regexp, (int) strlen(regexp), &info)) < 0) return result;
+
+  memset(pi, 0, sizeof(*pi));
+  pi->plan = info.plan.plan;
+  pi->two_pass_captures = num_caps > 0 && info.num_brackets > 1 &&
+    info.plan.plan != SLRE_PLAN_ANCHORED;
+  pi->is_literal = info.literal_len >= 0;
+  pi->is_anchored = regexp[0] == '^';
+  pi->num_groups = info.num_brackets - 1;
+  pi->alternation_width = 1;
+
+  for (i = 0; i < info.num_brackets; i++) {
+    b = &brackets[i];
+    if (b->num_branches + 1 > pi->alternation_width) {
+      pi->alternation_width = b->num_branches + 1;
+    }
+    end = b->offset + b->len + 1;  /* Points after the closing bracket */
+    if (i > 0 && end < brackets[0].len && is_quantifier(regexp + end) &&
+        has_quantifier(regexp + b->offset, b->len)) {
+      pi->has_nested_quantifiers = 1;
+    }
+  }
+
+  return 0;
 }
 
 int slre_match(const char *regexp, const char *s, int s_len,
                struct slre_cap *caps, int num_caps, int flags) {
+  struct bracket_pair brackets[MAX_BRACKETS];
+  struct branch branches[MAX_BRANCHES];
   struct regex_info info;
+  int re_len, result;
 
   /* Initialize info structure */
+  info.brackets = brackets;
+  info.branches = branches;
   info.flags = flags;
   info.num_brackets = info.num_branches = 0;
   info.num_caps = num_caps;
   info.caps = caps;
 
   DBG(("========================> [%s] [%.*s]\n", regexp, s_len, s));
-  return foo(regexp, (int) strlen(regexp), s, s_len, &info);
+  if (cache_lookup(regexp, &info)) {
+    FAIL_IF(num_caps > 0 && info.num_brackets - 1 > num_caps,
+            SLRE_CAPS_ARRAY_TOO_SMALL);
+  } else {
+    re_len = (int) strlen(regexp);
+    if ((result = foo(regexp, re_len, &info)) < 0) return result;
+    cache_insert(regexp, re_len, &info);
+  }
+
+  return baz(s, s_len, &info);
 }
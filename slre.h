@@ -38,6 +38,63 @@ struct slre_cap {
 int slre_match(const char *regexp, const char *buf, int buf_len,
                struct slre_cap *caps, int num_caps, int flags);
 
+/*
+ * Pattern cache statistics. Parsed patterns are cached only if the library
+ * is compiled with -DSLRE_ENABLE_CACHE, otherwise all counters are zero.
+ */
+struct slre_cache_stats {
+  unsigned long hits;       /* Calls that reused a parsed pattern    */
+  unsigned long misses;     /* Calls that had to parse the pattern   */
+  unsigned long evictions;  /* Cached entries replaced               */
+  int size;                 /* Number of cached patterns             */
+  int capacity;             /* Maximum number of cached patterns     */
+};
+
+void slre_cache_stats(struct slre_cache_stats *stats);
+void slre_cache_clear(void);
+
+/*
+ * Parsed regular expressions in a flat binary format, which can be saved
+ * to disk and later used in place, e.g. from a memory-mapped file.
+ * Buffers must be aligned to sizeof(int).
+ */
+int slre_compile(const char *regexp, void *buf, int buf_len);
+int slre_check_compiled(const void *buf, int buf_len);
+int slre_match_compiled(const void *compiled, const char *buf, int buf_len,
+                        struct slre_cap *caps, int num_caps, int flags);
+
+/* Sets of compiled regular expressions */
+int slre_compile_set(const char **regexps, int num_regexps,
+                     void *buf, int buf_len);
+int slre_check_set(const void *buf, int buf_len);
+const void *slre_set_get(const void *set, int index);
+
+/*
+ * Describes a regular expression and the way slre_match() executes it.
+ * Filled in by slre_plan().
+ */
+struct slre_pattern_info {
+  int plan;                   /* SLRE_PLAN_*, see below                */
+  int two_pass_captures;      /* Captures are filled in a second pass  */
+  int is_literal;             /* Matches a fixed string                */
+  int is_anchored;            /* Starts with ^                         */
+  int num_groups;             /* Number of bracket pairs               */
+  int has_nested_quantifiers; /* Quantified group contains quantifier  */
+  int alternation_width;      /* Most alternatives in one group        */
+};
+
+int slre_plan(const char *regexp, int num_caps,
+              struct slre_pattern_info *info);
+
+/* Execution plans chosen by slre_match() */
+enum {
+  SLRE_PLAN_LITERAL = 1,      /* Fixed string search                   */
+  SLRE_PLAN_ANCHORED,         /* Single attempt at the buffer start    */
+  SLRE_PLAN_FIRST_BYTE,       /* Backtracking where first byte matches */
+  SLRE_PLAN_FIRST_BYTE_SET,   /* Same, any alternative's first byte    */
+  SLRE_PLAN_BACKTRACK         /* Backtracking at every offset          */
+};
+
 /* Possible flags for slre_match() */
 enum { SLRE_IGNORE_CASE = 1 };
 
@@ -52,6 +109,8 @@ enum { SLRE_IGNORE_CASE = 1 };
 #define SLRE_CAPS_ARRAY_TOO_SMALL   -7
 #define SLRE_TOO_MANY_BRANCHES      -8
 #define SLRE_TOO_MANY_BRACKETS      -9
+#define SLRE_BUFFER_TOO_SMALL       -10
+#define SLRE_INVALID_COMPILED       -11
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2013 Cesanta Software Limited
+ * All rights reserved
+ *
+ * This software is dual-licensed: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. For the terms of this
+ * license, see <http://www.gnu.org/licenses/>.
+ *
+ * You are free to use this software under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * Alternatively, you can license this software under a commercial
+ * license, as set out in <http://cesanta.com/products.html>.
+ */
+
+/*
+ * Multithreaded grep built on SLRE. Input files are memory-mapped and split
+ * on line boundaries into chunks, which worker threads match in parallel.
+ * Output is written in input order. Requires POSIX. Build with:
+ *
+ *    cc -O2 -o slre_grep slre_grep.c slre.c -lpthread
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "slre.h"
+
+#define MAX_CAPS 100
+#define CHUNK_SIZE (4 * 1024 * 1024)
+#define MAX_THREADS 256
+
+struct options {
+  int ignore_case;    /* -i */
+  int count;          /* -c */
+  int only_matching;  /* -o */
+  int invert;         /* -v */
+  int groups;         /* -g */
+  int anchored;       /* Regex starts with ^ */
+  int stats;          /* -s */
+  int num_threads;    /* -j */
+  int num_groups;     /* Number of capturing groups in the regex */
+};
+
+struct out_buf {
+  char *ptr;
+  size_t len;
+  size_t size;
+};
+
+/* Work for one thread: a range of complete lines */
+struct chunk {
+  const char *start;
+  const char *end;
+  const char *prefix;     /* File name prefix, or NULL */
+  struct out_buf out;
+  unsigned long num_selected;
+  unsigned long num_lines;
+};
+
+static struct options s_opts;
+static void *s_compiled;
+static void *s_wrapped;   /* For -o, NULL if every match is empty */
+
+static void out_append(struct out_buf *b, const char *p, size_t len) {
+  if (b->len + len > b->size) {
+    b->size = (b->len + len) * 2;
+    if ((b->ptr = (char *) realloc(b->ptr, b->size)) == NULL) {
+      fprintf(stderr, "slre_grep: out of memory\n");
+      exit(2);
+    }
+  }
+  memcpy(b->ptr + b->len, p, len);
+  b->len += len;
+}
+
+static void out_str(struct out_buf *b, const char *s) {
+  out_append(b, s, strlen(s));
+}
+
+/* Pass NULL caps unless captures are printed */
+static int match(const void *compiled, const char *s, int len,
+                 struct slre_cap *caps) {
+  if (caps != NULL) memset(caps, 0, MAX_CAPS * sizeof(caps[0]));
+  return slre_match_compiled(compiled, s, len, caps, caps ? MAX_CAPS : 0,
+                             s_opts.ignore_case ? SLRE_IGNORE_CASE : 0);
+}
+
+static void print_groups(struct out_buf *b, const struct slre_cap *caps) {
+  int i;
+
+  for (i = 0; i < s_opts.num_groups; i++) {
+    if (i > 0) out_append(b, "\t", 1);
+    if (caps[i].ptr != NULL) out_append(b, caps[i].ptr, caps[i].len);
+  }
+  out_append(b, "\n", 1);
+}
+
+/*
+ * Lines are selected with the regex as given, which keeps its fast plan.
+ * For -o, matched lines are matched again against a copy of the regex
+ * wrapped into an extra bracket pair, so the first capture holds the
+ * matched text and user groups start at the second one.
+ */
+static void process_line(struct chunk *c, const char *line, int len) {
+  struct slre_cap caps[MAX_CAPS];
+  int n, ofs = 0, print_groups_only = s_opts.groups && !s_opts.invert &&
+    !s_opts.only_matching && !s_opts.count;
+
+  n = match(s_compiled, line, len, print_groups_only ? caps : NULL);
+  c->num_lines++;
+  if ((n >= 0) == s_opts.invert) return;
+  c->num_selected++;
+
+  /* Like grep, -o -v prints nothing: non-matching lines have no matches */
+  if (s_opts.count || (s_opts.only_matching && s_opts.invert)) return;
+
+  if (s_opts.only_matching) {
+    /* Like grep, -o skips empty matches */
+    if (s_wrapped == NULL) return;
+    n = match(s_wrapped, line, len, caps);
+    while (n >= 0) {
+      if (caps[0].len > 0) {
+        if (c->prefix != NULL) out_str(&c->out, c->prefix);
+        if (s_opts.groups) {
+          print_groups(&c->out, caps + 1);
+        } else {
+          out_append(&c->out, caps[0].ptr, caps[0].len);
+          out_append(&c->out, "\n", 1);
+        }
+      }
+      /* Step over empty matches to guarantee progress */
+      ofs += n > 0 ? n : 1;
+      if (ofs >= len || s_opts.anchored) break;
+      n = match(s_wrapped, line + ofs, len - ofs, caps);
+    }
+  } else {
+    if (c->prefix != NULL) out_str(&c->out, c->prefix);
+    if (s_opts.groups && !s_opts.invert) {
+      print_groups(&c->out, caps);
+    } else {
+      out_append(&c->out, line, len);
+      out_append(&c->out, "\n", 1);
+    }
+  }
+}
+
+static void *worker(void *param) {
+  struct chunk *c = (struct chunk *) param;
+  const char *p = c->start, *eol;
+
+  while (p < c->end) {
+    if ((eol = (const char *) memchr(p, '\n', c->end - p)) == NULL) {
+      eol = c->end;
+    }
+    process_line(c, p, (int) (eol - p));
+    p = eol + 1;
+  }
+
+  return NULL;
+}
+
+/* Matches the whole buffer, returns the number of selected lines */
+static unsigned long grep_buf(const char *buf, size_t len, const char *prefix,
+                              unsigned long *num_lines) {
+  static struct chunk chunks[MAX_THREADS];
+  pthread_t threads[MAX_THREADS];
+  const char *p = buf, *end = buf + len, *eol;
+  unsigned long num_selected = 0;
+  int i, n;
+
+  *num_lines = 0;
+  while (p < end) {
+    /* Split the next round of input into one chunk per thread */
+    for (n = 0; n < s_opts.num_threads && p < end; n++) {
+      eol = end - p > CHUNK_SIZE ? p + CHUNK_SIZE : end;
+      if (eol < end && (eol = (const char *) memchr(eol, '\n', end - eol)) ==
+          NULL) {
+        eol = end;
+      }
+      chunks[n].start = p;
+      chunks[n].end = eol;
+      chunks[n].prefix = prefix;
+      chunks[n].out.len = 0;
+      chunks[n].num_selected = chunks[n].num_lines = 0;
+      p = eol < end ? eol + 1 : end;
+    }
+
+    for (i = 0; i < n; i++) {
+      if (n == 1 || pthread_create(&threads[i], NULL, worker, &chunks[i])) {
+        worker(&chunks[i]);
+        threads[i] = pthread_self();
+      }
+    }
+    for (i = 0; i < n; i++) {
+      if (!pthread_equal(threads[i], pthread_self())) {
+        pthread_join(threads[i], NULL);
+      }
+      fwrite(chunks[i].out.ptr, 1, chunks[i].out.len, stdout);
+      num_selected += chunks[i].num_selected;
+      *num_lines += chunks[i].num_lines;
+    }
+  }
+
+  return num_selected;
+}
+
+static char *read_stream(FILE *fp, size_t *len) {
+  struct out_buf b = { NULL, 0, 0 };
+  char tmp[BUFSIZ];
+  size_t n;
+
+  while ((n = fread(tmp, 1, sizeof(tmp), fp)) > 0) {
+    out_append(&b, tmp, n);
+  }
+  *len = b.len;
+
+  return b.ptr;
+}
+
+/* Returns the number of selected lines, or -1 on error */
+static long grep_file(const char *path, int print_name,
+                      unsigned long *num_bytes, unsigned long *num_lines) {
+  struct stat st;
+  const char *buf = NULL;
+  char *prefix = NULL;
+  size_t len = 0;
+  unsigned long n = 0;
+  int fd = -1;
+
+  if (path == NULL) {
+    buf = read_stream(stdin, &len);
+  } else if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "slre_grep: %s: %s\n", path, strerror(errno));
+    if (fd >= 0) close(fd);
+    return -1;
+  } else if ((len = (size_t) st.st_size) > 0) {
+    buf = (const char *) mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == (const char *) MAP_FAILED) {
+      fprintf(stderr, "slre_grep: %s: %s\n", path, strerror(errno));
+      close(fd);
+      return -1;
+    }
+  }
+
+  if (print_name && !s_opts.count) {
+    prefix = (char *) malloc(strlen(path) + 2);
+    sprintf(prefix, "%s:", path);
+  }
+  if (len > 0) n = grep_buf(buf, len, prefix, num_lines);
+  if (s_opts.count) {
+    if (print_name) printf("%s:", path);
+    printf("%lu\n", n);
+  }
+  *num_bytes = (unsigned long) len;
+
+  free(prefix);
+  if (path == NULL) {
+    free((void *) buf);
+  } else {
+    if (len > 0) munmap((void *) buf, len);
+    close(fd);
+  }
+
+  return (long) n;
+}
+
+static const char *error_str(int code) {
+  switch (code) {
+    case SLRE_UNEXPECTED_QUANTIFIER: return "unexpected quantifier";
+    case SLRE_UNBALANCED_BRACKETS: return "unbalanced brackets";
+    case SLRE_INVALID_CHARACTER_SET: return "invalid character set";
+    case SLRE_INVALID_METACHARACTER: return "invalid metacharacter";
+    case SLRE_TOO_MANY_BRANCHES: return "too many branches";
+    case SLRE_TOO_MANY_BRACKETS: return "too many brackets";
+    default: return "invalid regular expression";
+  }
+}
+
+/* Parses once, every line is then matched against the compiled regex */
+static void *compile(const char *regex) {
+  void *compiled;
+  int size;
+
+  if ((size = slre_compile(regex, NULL, 0)) < 0) {
+    fprintf(stderr, "slre_grep: %s\n", error_str(size));
+    exit(2);
+  }
+  compiled = malloc(size);
+  slre_compile(regex, compiled, size);
+
+  return compiled;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: slre_grep [-ciogvs] [-j threads] regex [file ...]\n"
+          "  -c  print the number of selected lines per file\n"
+          "  -i  ignore case\n"
+          "  -o  print every matched part of a line instead of the line\n"
+          "  -g  print captured groups, separated by tabs\n"
+          "  -v  select lines that do not match\n"
+          "  -s  print throughput statistics to stderr\n"
+          "  -j  number of threads, default is the number of CPUs\n");
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long total_bytes = 0, total_lines = 0, num_bytes, num_lines;
+  struct timespec t1, t2;
+  struct slre_pattern_info pi;
+  const char *regex, *body;
+  char *wrapped;
+  long n;
+  int opt, i, found = 0, failed = 0;
+
+  s_opts.num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt(argc, argv, "ciogvsj:")) != -1) {
+    switch (opt) {
+      case 'c': s_opts.count = 1; break;
+      case 'i': s_opts.ignore_case = 1; break;
+      case 'o': s_opts.only_matching = 1; break;
+      case 'g': s_opts.groups = 1; break;
+      case 'v': s_opts.invert = 1; break;
+      case 's': s_opts.stats = 1; break;
+      case 'j': s_opts.num_threads = atoi(optarg); break;
+      default: usage(); break;
+    }
+  }
+  if (optind >= argc) usage();
+  if (s_opts.num_threads < 1) s_opts.num_threads = 1;
+  if (s_opts.num_threads > MAX_THREADS) s_opts.num_threads = MAX_THREADS;
+
+  regex = argv[optind++];
+  s_compiled = compile(regex);
+  slre_plan(regex, 0, &pi);
+  s_opts.num_groups = pi.num_groups;
+  s_opts.anchored = pi.is_anchored;
+
+  /*
+   * Keep the anchor outside, it only works at the start of the regex. An
+   * empty body would make "()", which does not parse, and it only has
+   * empty matches, which -o does not print anyway.
+   */
+  body = regex[0] == '^' ? regex + 1 : regex;
+  if (s_opts.only_matching && !s_opts.count && body[0] != '\0') {
+    wrapped = (char *) malloc(strlen(regex) + 3);
+    sprintf(wrapped, "%s(%s)", regex[0] == '^' ? "^" : "", body);
+    s_wrapped = compile(wrapped);
+    free(wrapped);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  for (i = optind; i < argc || i == optind; i++) {
+    n = grep_file(i < argc ? argv[i] : NULL, argc - optind > 1,
+                  &num_bytes, &num_lines);
+    if (n < 0) {
+      failed = 1;
+    } else {
+      found |= n > 0;
+      total_bytes += num_bytes;
+      total_lines += num_lines;
+    }
+  }
+  fflush(stdout);
+  clock_gettime(CLOCK_MONOTONIC, &t2);
+
+  if (s_opts.stats) {
+    double secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+    fprintf(stderr, "%lu bytes, %lu lines, %d threads, %.3f s, %.1f MB/s\n",
+            total_bytes, total_lines, s_opts.num_threads, secs,
+            secs > 0 ? total_bytes / secs / (1024 * 1024) : 0.0);
+  }
+
+  free(s_compiled);
+  free(s_wrapped);
+
+  return failed ? 2 : found ? 0 : 1;
+}
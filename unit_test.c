@@ -174,6 +174,18 @@ int main(void) {
   ASSERT(slre_match("\\n", "abc\ndef", 7, NULL, 0, 0) == 4);
   ASSERT(slre_match("b.\\s*\\n", "aa\r\nbb\r\ncc\r\n\r\n", 14,
                     caps, 10, 0) == 8);
+  ASSERT(slre_match("(\\d+)x", "12y34x", 6, caps, 10, 0) == 6);
+  ASSERT(caps[0].len == 2);
+  ASSERT(memcmp(caps[0].ptr, "34", 2) == 0);
+  ASSERT(slre_match("(a|b)(c)", "abacbc", 6, caps, 10, 0) == 4);
+  ASSERT(caps[0].len == 1 && caps[0].ptr[0] == 'a');
+  ASSERT(caps[1].len == 1 && caps[1].ptr[0] == 'c');
+
+  /* Captures are filled in at the matched offset only */
+  caps[0].ptr = NULL;
+  caps[0].len = 0;
+  ASSERT(slre_match("(a)b", "acad", 4, caps, 10, 0) == SLRE_NO_MATCH);
+  ASSERT(caps[0].ptr == NULL && caps[0].len == 0);
 
   /* Greedy vs non-greedy */
   ASSERT(slre_match(".+c", "abcabc", 6, NULL, 0, 0) == 6);
@@ -220,6 +232,207 @@ int main(void) {
   ASSERT(slre_match("[A-H]+", "abcdefghyyy", 11, NULL, 0, 0) == SLRE_NO_MATCH);
   ASSERT(slre_match("[a-h]+", "ABCDEFGHyyy", 11, NULL, 0, SLRE_IGNORE_CASE) == 8);
   ASSERT(slre_match("[A-H]+", "abcdefghyyy", 11, NULL, 0, SLRE_IGNORE_CASE) == 8);
+  ASSERT(slre_match("host:\\s*(\\S+)",
+                    "Accept: */*\r\nHOST: example.com\r\n", 32,
+                    caps, 1, SLRE_IGNORE_CASE) == 30);
+  ASSERT(caps[0].len == 11);
+  ASSERT(memcmp(caps[0].ptr, "example.com", 11) == 0);
+  ASSERT(slre_match("HOST", "xxxxxxxxxxxxxxxxxxxxhost", 24, NULL, 0,
+                    SLRE_IGNORE_CASE) == 24);
+  ASSERT(slre_match("HOST", "xxxxxxxxxxxxxxxxxxxxhost", 24, NULL, 0, 0) ==
+         SLRE_NO_MATCH);
+  ASSERT(slre_match("h", "xxxxxxxxxxxxxxxH", 16, NULL, 0,
+                    SLRE_IGNORE_CASE) == 16);
+  ASSERT(slre_match("h", "xxxxxxxxxxxxxxxxH", 17, NULL, 0,
+                    SLRE_IGNORE_CASE) == 17);
+  ASSERT(slre_match("h", "xxxxxxxxxxxxxxxxxxxxxxx", 23, NULL, 0,
+                    SLRE_IGNORE_CASE) == SLRE_NO_MATCH);
+  ASSERT(slre_match("@", "xxxxxxxxxxxxxxxx`", 17, NULL, 0,
+                    SLRE_IGNORE_CASE) == SLRE_NO_MATCH);
+  ASSERT(slre_match("\\x4a", "xxxxxxxxjJ", 10, NULL, 0,
+                    SLRE_IGNORE_CASE) == 10);
+  ASSERT(slre_match("\\.c", "a.b.c", 5, NULL, 0, 0) == 5);
+  ASSERT(slre_match("k*a", "xxkxxa", 6, NULL, 0, 0) == 6);
+  ASSERT(slre_match("k?a", "xxkxxa", 6, NULL, 0, 0) == 6);
+  ASSERT(slre_match("k+a", "xxkxkkax", 8, NULL, 0, 0) == 7);
+
+  {
+    /* Execution plans */
+    struct slre_pattern_info pi;
+
+    ASSERT(slre_plan("example\\.com", 0, &pi) == 0);
+    ASSERT(pi.plan == SLRE_PLAN_LITERAL);
+    ASSERT(pi.is_literal && !pi.is_anchored && pi.num_groups == 0);
+    ASSERT(slre_plan("^GET /", 0, &pi) == 0);
+    ASSERT(pi.plan == SLRE_PLAN_LITERAL && pi.is_anchored);
+    ASSERT(slre_plan("^(\\S+) (\\S+)", 2, &pi) == 0);
+    ASSERT(pi.plan == SLRE_PLAN_ANCHORED && !pi.two_pass_captures);
+    ASSERT(pi.num_groups == 2);
+    ASSERT(slre_plan("host: (\\S+)", 1, &pi) == 0);
+    ASSERT(pi.plan == SLRE_PLAN_FIRST_BYTE && pi.two_pass_captures);
+    ASSERT(slre_plan("host: (\\S+)", 0, &pi) == 0);
+    ASSERT(!pi.two_pass_captures);
+    ASSERT(slre_plan("GET|POST|P(UT|ATCH|URGE)", 0, &pi) == 0);
+    ASSERT(pi.plan == SLRE_PLAN_FIRST_BYTE_SET);
+    ASSERT(pi.alternation_width == 3 && !pi.has_nested_quantifiers);
+    ASSERT(slre_plan("a?b|c", 0, &pi) == 0);
+    ASSERT(pi.plan == SLRE_PLAN_BACKTRACK);
+    ASSERT(slre_plan("(a+b)*c", 0, &pi) == 0);
+    ASSERT(pi.plan == SLRE_PLAN_BACKTRACK && pi.has_nested_quantifiers);
+    ASSERT(pi.alternation_width == 1);
+    ASSERT(slre_plan("(a+b)c", 0, &pi) == 0);
+    ASSERT(!pi.has_nested_quantifiers);
+    ASSERT(slre_plan("(a)(b)", 1, &pi) == SLRE_CAPS_ARRAY_TOO_SMALL);
+    ASSERT(slre_plan("(x))", 0, &pi) == SLRE_UNBALANCED_BRACKETS);
+
+    /* Literal search */
+    ASSERT(slre_match("example\\.com", "www.example.com", 15,
+                      NULL, 0, 0) == 15);
+    ASSERT(slre_match("example\\.com", "www.exampleXcom", 15,
+                      NULL, 0, 0) == SLRE_NO_MATCH);
+    ASSERT(slre_match("EXAMPLE\\x2ecom", "www.example.com", 15,
+                      NULL, 0, SLRE_IGNORE_CASE) == 15);
+    ASSERT(slre_match("ab$", "abab", 4, NULL, 0, 0) == 4);
+    ASSERT(slre_match("ab$", "b", 1, NULL, 0, 0) == SLRE_NO_MATCH);
+    ASSERT(slre_match("^ab$", "ab", 2, NULL, 0, 0) == 2);
+    ASSERT(slre_match("^ab$", "abab", 4, NULL, 0, 0) == SLRE_NO_MATCH);
+    ASSERT(slre_match("^ba", "abab", 4, NULL, 0, 0) == SLRE_NO_MATCH);
+    ASSERT(slre_match("\\$", "a$b", 3, NULL, 0, 0) == 2);
+    ASSERT(slre_match("^$", "", 0, NULL, 0, 0) == 0);
+    ASSERT(slre_match("^$", "a", 1, NULL, 0, 0) == SLRE_NO_MATCH);
+    ASSERT(slre_match("", "a", 1, NULL, 0, 0) == 0);
+  }
+
+  {
+    /* Compiled regular expressions */
+    static const char *regexps[] = {
+      "^\\s*(\\S+)\\s+(\\S+)\\s+HTTP/(\\d)\\.(\\d)", "k(xx|yy)|ca|bc",
+      "(ab|cd).*\\.(xx|yy)", "FO"
+    };
+    static const char *str = " GET /index.html HTTP/1.0\r\n";
+    int buf[256], set[1024], n, size;
+
+    n = slre_compile(regexps[0], NULL, 0);
+    ASSERT(n > 0 && n <= (int) sizeof(buf));
+    ASSERT(slre_compile(regexps[0], buf, n - 1) == SLRE_BUFFER_TOO_SMALL);
+    ASSERT(slre_compile(regexps[0], buf, sizeof(buf)) == n);
+    ASSERT(slre_compile("(x))", buf, sizeof(buf)) ==
+           SLRE_UNBALANCED_BRACKETS);
+    ASSERT(slre_compile(regexps[0], buf, sizeof(buf)) == n);
+    ASSERT(slre_check_compiled(buf, n) == n);
+    ASSERT(slre_check_compiled(buf, n - 1) == SLRE_INVALID_COMPILED);
+    ASSERT(slre_match_compiled(buf, str, strlen(str), caps, 4, 0) ==
+           slre_match(regexps[0], str, strlen(str), caps, 4, 0));
+    ASSERT(caps[1].len == 11);
+    ASSERT(memcmp(caps[1].ptr, "/index.html", caps[1].len) == 0);
+    ASSERT(slre_match_compiled(buf, str, strlen(str), caps, 3, 0) ==
+           SLRE_CAPS_ARRAY_TOO_SMALL);
+
+    /* Corrupted data is rejected */
+    ((char *) buf)[n - 4] ^= 1;
+    ASSERT(slre_check_compiled(buf, n) == SLRE_INVALID_COMPILED);
+    ((char *) buf)[n - 4] ^= 1;
+    buf[0]++;
+    ASSERT(slre_check_compiled(buf, n) == SLRE_INVALID_COMPILED);
+    ASSERT(slre_match_compiled(buf, str, strlen(str), NULL, 0, 0) ==
+           SLRE_INVALID_COMPILED);
+
+    size = slre_compile_set(regexps, 4, NULL, 0);
+    ASSERT(size > 0 && size <= (int) sizeof(set));
+    ASSERT(slre_compile_set(regexps, 4, set, sizeof(set)) == size);
+    ASSERT(slre_check_set(set, size) == 4);
+    ASSERT(slre_check_set(set, size - 1) == SLRE_INVALID_COMPILED);
+    ASSERT(slre_set_get(set, 4) == NULL);
+    ASSERT(slre_match_compiled(slre_set_get(set, 1), "abcabc", 6,
+                               NULL, 0, 0) == 3);
+    ASSERT(slre_match_compiled(slre_set_get(set, 1), "xCAx", 4,
+                               NULL, 0, SLRE_IGNORE_CASE) == 3);
+    ASSERT(slre_match_compiled(slre_set_get(set, 1), "xCAx", 4,
+                               NULL, 0, 0) == SLRE_NO_MATCH);
+    ASSERT(slre_match_compiled(slre_set_get(set, 2), "ab.yy", 5,
+                               caps, 2, 0) == 5);
+    ASSERT(caps[1].len == 2 && memcmp(caps[1].ptr, "yy", 2) == 0);
+    ASSERT(slre_match_compiled(slre_set_get(set, 3), "foo", 3,
+                               NULL, 0, SLRE_IGNORE_CASE) == 2);
+    ((char *) set)[size - 1] ^= 1;
+    ASSERT(slre_check_set(set, size) == SLRE_INVALID_COMPILED);
+
+    /* Truncated or altered data is rejected */
+    n = slre_compile("(a|b)c", buf, sizeof(buf));
+    ASSERT(slre_check_compiled(buf, n) == n);
+    for (size = 0; size < n; size++) {
+      char *truncated = (char *) malloc(size > 0 ? size : 1);
+      memcpy(truncated, buf, size);
+      ASSERT(slre_check_compiled(truncated, size) == SLRE_INVALID_COMPILED);
+      free(truncated);
+    }
+    for (size = 0; size < n; size++) {
+      ((char *) buf)[size] ^= 0x10;
+      ASSERT(slre_check_compiled(buf, n) == SLRE_INVALID_COMPILED);
+      ((char *) buf)[size] ^= 0x10;
+    }
+    ASSERT(slre_check_compiled(buf, n) == n);
+
+    /* foo() leaves the length of bracket 3 at -1 here */
+    n = slre_compile("((a))((b))", buf, sizeof(buf));
+    ASSERT(n > 0);
+    ASSERT(slre_check_compiled(buf, n) == n);
+    ASSERT(slre_match_compiled(buf, "xab", 3, caps, 4, 0) ==
+           slre_match("((a))((b))", "xab", 3, caps, 4, 0));
+  }
+
+#ifdef SLRE_ENABLE_CACHE
+  {
+    /* Pattern cache */
+    struct slre_cache_stats stats;
+    char re[10], bufs[100][10];
+    int i;
+
+    slre_cache_clear();
+    ASSERT(slre_match("(\\d+)x", "12y34x", 6, caps, 10, 0) == 6);
+    ASSERT(slre_match("(\\d+)x", "12y34x", 6, caps, 10, 0) == 6);
+    ASSERT(memcmp(caps[0].ptr, "34", 2) == 0);
+    ASSERT(slre_match("(\\d+)x", "12y34x", 6, caps, 10,
+                      SLRE_IGNORE_CASE) == 6);
+    slre_cache_stats(&stats);
+    ASSERT(stats.hits == 1);
+    ASSERT(stats.misses == 2);
+    ASSERT(stats.size == 2);
+
+    /* Cached pattern still honours the size of the caps array */
+    ASSERT(slre_match("(\\d+)x", "12y34x", 6, caps, 0, 0) == 6);
+    ASSERT(slre_match("(a)(b)", "ab", 2, caps, 2, 0) == 2);
+    ASSERT(slre_match("(a)(b)", "ab", 2, caps, 1, 0) ==
+           SLRE_CAPS_ARRAY_TOO_SMALL);
+
+    /* Same address, different pattern */
+    strcpy(re, "a+");
+    ASSERT(slre_match(re, "xaab", 4, NULL, 0, 0) == 3);
+    strcpy(re, "b+");
+    ASSERT(slre_match(re, "xaab", 4, NULL, 0, 0) == 4);
+
+    slre_cache_stats(&stats);
+    ASSERT(stats.evictions == 1);
+
+    /* Least recently used entries are evicted */
+    slre_cache_clear();
+    ASSERT(stats.capacity < (int) (sizeof(bufs) / sizeof(bufs[0])));
+    for (i = 0; i <= stats.capacity; i++) {
+      if (i == stats.capacity) {
+        ASSERT(slre_match(bufs[0], "x0", 2, NULL, 0, 0) == 2);
+      }
+      sprintf(bufs[i], "x%d", i);
+      ASSERT(slre_match(bufs[i], bufs[i], strlen(bufs[i]), NULL, 0, 0) ==
+             (int) strlen(bufs[i]));
+    }
+    ASSERT(slre_match(bufs[0], "x0", 2, NULL, 0, 0) == 2);
+    ASSERT(slre_match(bufs[1], "x1", 2, NULL, 0, 0) == 2);
+    slre_cache_stats(&stats);
+    ASSERT(stats.size == stats.capacity);
+    ASSERT(stats.evictions == 2);
+    ASSERT(stats.hits == 2);
+  }
+#endif
 
   {
     /* Example: HTTP request */